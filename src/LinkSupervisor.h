@@ -0,0 +1,253 @@
+/*
+ * Este archivo es parte del proyecto EbyteNT1AT.
+ *
+ * Este trabajo ha sido dedicado al dominio público bajo la licencia CC0 1.0 Universal.
+ * Para ver una copia de esta licencia, visite:
+ * https://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * Renunciamos a todos los derechos de autor y derechos conexos en la mayor medida
+ * permitida por la ley aplicable.
+ *
+ * Autor: Javier Rambaldo
+ * Fecha: 21 de junio de 2024
+ */
+
+#pragma once
+#include <Arduino.h>
+#include "EbyteNT1AT.h"
+
+// Supervisor del enlace del NT1.
+//
+// La vigilancia es barata: la aplicacion llama a Feed() cada vez que recibe algo valido del
+// otro extremo (una respuesta Modbus OK, o el eco del heartbeat con CheckHeartbeatEcho()).
+// Solo si se deja de recibir se entra en modo AT para preguntar AT+LINKSTA. Si el modulo dice
+// Connect pero igual no llega nada (socket medio abierto, PLC que no contesta), despues de
+// maxSilentChecks consultas se considera caido igual.
+//
+// La caida termina solo con un Feed() (AT+LINKSTA=Connect no alcanza: el socket puede estar
+// medio abierto), y cada etapa escala si no llega nada en su tiempo.
+//
+// Escalado de la recuperacion:
+//   1) Wait:   espero que el modulo reconecte solo (con los timers cortos de AT+TMOLINK).
+//   2) Reopen: reescribo AT+SOCK (SetWorkingMode), una sola vez por caida. No esta confirmado
+//              que el NT1 reabra el socket solo con esto (en main.cpp hizo falta reiniciar para
+//              que tome la config), por eso si no vuelve se pasa al reboot.
+//   3) Reboot: reinicio el modulo (AT+REBT). Si sigue caido se reintenta el reboot, duplicando
+//              la espera cada vez hasta maxRebootMs. No se vuelve a escribir AT+SOCK.
+//
+// Por cada caida se loguea el tiempo de recuperacion, y se acumula para sacar la media.
+class LinkSupervisor
+{
+   public:
+    static const uint8_t StateLinkUp = 0;
+    static const uint8_t StateWait   = 1;
+    static const uint8_t StateReopen = 2;
+    static const uint8_t StateReboot = 3;
+
+    // tiempos (ms) de cada etapa, se pueden ajustar antes de llamar a Begin():
+    uint32_t silenceMs      = 5000;    // sin Feed() durante este tiempo => sospecho caida
+    uint32_t waitMarginMs   = 2000;    // etapa 1: margen sobre los reintentos de AT+TMOLINK
+    uint32_t waitMs         = 8000;    // etapa 1: lo calcula ApplyFastTimers() (2s x 3 + margen)
+    uint32_t reopenMs       = 8000;    // etapa 2: espero despues de reescribir AT+SOCK
+    uint32_t rebootMs       = 15000;   // etapa 3: espera despues del primer reinicio
+    uint32_t maxRebootMs    = 300000;  // etapa 3: tope de la espera entre reinicios
+    uint8_t maxSilentChecks = 2;       // consultas "Connect pero sin datos" antes de darlo por caido
+
+    // estadisticas de las caidas:
+    uint32_t outages       = 0;  // cant de caidas recuperadas
+    uint32_t lastOutageMs  = 0;  // duracion de la ultima caida
+    uint32_t totalOutageMs = 0;
+    uint32_t maxOutageMs   = 0;
+
+   private:
+    EbyteNT1AT& nt1;
+    uint8_t workMode;
+    String remoteIP;
+    int remotePort;
+
+    uint8_t state        = StateLinkUp;
+    uint8_t worstStage   = StateLinkUp;  // la etapa mas alta a la que se llego en la caida actual
+    uint32_t lastFeed    = 0;            // ultimo dato valido recibido
+    uint32_t outageStart = 0;            // = lastFeed al detectar la caida
+    uint32_t stageStart  = 0;
+    uint32_t lastCheck   = 0;  // ultima consulta AT+LINKSTA estando LinkUp
+    uint8_t silentChecks = 0;
+    uint32_t rebootWait  = 0;  // espera actual de la etapa 3 (con backoff)
+    String heartbeatData;      // lo que manda el NT1 como heartbeat (vacio = sin heartbeat)
+
+    // entra a modo AT, pregunta el estado del enlace y sale.
+    // Respuesta: +OK=Connect o +OK=Disconnect
+    bool QueryConnected()
+    {
+        if (!nt1.GoIntoAT()) return false;
+        String s       = nt1.QueryLinkStatus();
+        bool connected = strstr(s.c_str(), "+OK") && strstr(s.c_str(), "Connect") && !strstr(s.c_str(), "Disconnect");
+        nt1.ExitAT();
+        return connected;
+    }
+
+    void ReopenSocket()
+    {
+        if (nt1.GoIntoAT())
+        {
+            nt1.SetWorkingMode(workMode, remoteIP, remotePort);
+            nt1.ExitAT();
+        }
+    }
+
+    void Reboot()
+    {
+        if (nt1.GoIntoAT()) nt1.Restart();
+        Enter(StateReboot);
+    }
+
+    void Enter(uint8_t newState)
+    {
+        state      = newState;
+        stageStart = millis();
+        if (newState > worstStage) worstStage = newState;
+    }
+
+    void Recovered()
+    {
+        uint32_t now = millis();
+        lastOutageMs = now - outageStart;
+        totalOutageMs += lastOutageMs;
+        if (lastOutageMs > maxOutageMs) maxOutageMs = lastOutageMs;
+        outages++;
+        Serial.printf("Link: recuperado en %u ms (etapa %u), caidas=%u media=%u ms max=%u ms\n", lastOutageMs, worstStage, outages, MeanOutageMs(), maxOutageMs);
+        state        = StateLinkUp;
+        worstStage   = StateLinkUp;
+        lastFeed     = now;
+        lastCheck    = now;
+        silentChecks = 0;
+    }
+
+    void Down(uint8_t stage)
+    {
+        outageStart = lastFeed;  // la caida empezo con el ultimo dato valido, no con la consulta
+        Enter(stage);
+    }
+
+   public:
+    LinkSupervisor(EbyteNT1AT& Nt1) : nt1(Nt1), workMode(EbyteNT1AT::WorkModeTcpClient), remotePort(0) {}
+
+    // guardo los parametros del socket para poder reabrirlo en la etapa 2.
+    void Begin(uint8_t mode, String remoteIP, int remotePort)
+    {
+        this->workMode   = mode;
+        this->remoteIP   = remoteIP;
+        this->remotePort = remotePort;
+        state            = StateLinkUp;
+        worstStage       = StateLinkUp;
+        lastFeed         = millis();
+        lastCheck        = lastFeed;
+        silentChecks     = 0;
+    }
+
+    // Carga en el modulo timers cortos (reemplazan a los de fabrica, que tardan minutos):
+    //   reconnectTime, reconnectNum: AT+TMOLINK (1-255 s, 1-60 veces). La etapa 1 espera
+    //     reconnectTime * reconnectNum + waitMarginMs, asi quedan siempre en sintonia.
+    //   heartbeatTime, heartbeatData: AT+HEARTMOD=NET y AT+HEARTINFO=STR. Por defecto apagado.
+    //     Solo sirve si el servidor devuelve el eco; NO usarlo contra un PLC Modbus TCP, esos
+    //     bytes no son MBAP y muchos PLC cortan la conexion.
+    // Hay que estar en modo AT. Retorna true si todos respondieron +OK.
+    bool ApplyFastTimers(int reconnectTime = 2, int reconnectNum = 3, int heartbeatTime = 0, String heartbeatData = "")
+    {
+        bool ok = true;
+        ok &= strstr(nt1.SetReconnection(String(reconnectTime), String(reconnectNum)).c_str(), "+OK") != NULL;
+        if (heartbeatTime > 0 && heartbeatData.length() > 0)
+        {
+            ok &= strstr(nt1.SetHeartbeatData("STR", heartbeatData).c_str(), "+OK") != NULL;
+            ok &= strstr(nt1.SetHeartbeat("NET", String(heartbeatTime)).c_str(), "+OK") != NULL;
+            this->heartbeatData = heartbeatData;
+        }
+        else
+        {
+            ok &= strstr(nt1.SetHeartbeat("NONE", "0").c_str(), "+OK") != NULL;
+            this->heartbeatData = "";
+        }
+        waitMs = (uint32_t)reconnectTime * reconnectNum * 1000 + waitMarginMs;
+        return ok;
+    }
+
+    // para modo transparente: pasarle lo recibido del NT1; si es el eco del heartbeat hace Feed().
+    bool CheckHeartbeatEcho(const uint8_t* data, size_t len)
+    {
+        size_t hbLen = heartbeatData.length();
+        if (hbLen == 0 || len < hbLen) return false;
+        for (size_t i = 0; i + hbLen <= len; i++)
+        {
+            if (memcmp(&data[i], heartbeatData.c_str(), hbLen) == 0)
+            {
+                Feed();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // llamar cada vez que llega un dato valido del otro extremo (eco del heartbeat, respuesta Modbus, etc)
+    void Feed()
+    {
+        if (state != StateLinkUp)
+            Recovered();
+        else
+        {
+            lastFeed     = millis();
+            silentChecks = 0;
+        }
+    }
+
+    // llamar seguido desde el loop(). Solo bloquea cuando tiene que mandar comandos AT.
+    void Loop()
+    {
+        uint32_t now = millis();
+
+        switch (state)
+        {
+            case StateLinkUp:
+                if (now - lastFeed < silenceMs || now - lastCheck < silenceMs) return;
+                // silencio: antes de escalar, pregunto al modulo (fallback)
+                if (QueryConnected())
+                {
+                    lastCheck = millis();
+                    if (++silentChecks < maxSilentChecks) return;
+                    // el modulo dice Connect pero no llega nada: no sirve esperar su reconexion
+                    Serial.println("Link: conectado pero sin datos, reabro el socket");
+                    ReopenSocket();
+                    Down(StateReopen);
+                    break;
+                }
+                Serial.println("Link: caido, espero reconexion");
+                Down(StateWait);
+                break;
+
+            case StateWait:
+                if (now - stageStart < waitMs) return;
+                Serial.println("Link: reabro el socket");
+                ReopenSocket();
+                Enter(StateReopen);
+                break;
+
+            case StateReopen:
+                if (now - stageStart < reopenMs) return;
+                Serial.println("Link: reinicio el modulo");
+                rebootWait = rebootMs;
+                Reboot();
+                break;
+
+            case StateReboot:
+                if (now - stageStart < rebootWait) return;
+                // sigue caido: reintento el reboot, cada vez esperando el doble.
+                rebootWait = min(rebootWait * 2, maxRebootMs);
+                Serial.printf("Link: sigue caido, reinicio de nuevo (proximo en %u ms)\n", rebootWait);
+                Reboot();
+                break;
+        }
+    }
+
+    uint8_t State() { return state; }
+    bool IsLinkUp() { return state == StateLinkUp; }
+    uint32_t MeanOutageMs() { return outages ? totalOutageMs / outages : 0; }
+};
@@ -0,0 +1,578 @@
+/*
+ * Este archivo es parte del proyecto EbyteNT1AT.
+ *
+ * Este trabajo ha sido dedicado al dominio público bajo la licencia CC0 1.0 Universal.
+ * Para ver una copia de esta licencia, visite:
+ * https://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * Renunciamos a todos los derechos de autor y derechos conexos en la mayor medida
+ * permitida por la ley aplicable.
+ *
+ * Autor: Javier Rambaldo
+ * Fecha: 21 de junio de 2024
+ */
+
+#pragma once
+#include <Arduino.h>
+#include "driver/uart.h"
+#include "ModbusRTU.h"  // crc16_update
+
+#define READ_COILS                0x01
+#define READ_DISCRETE_INPUTS      0x02
+#define READ_INPUT_REGISTERS      0x04
+#define WRITE_SINGLE_COIL         0x05
+#define WRITE_SINGLE_REGISTER     0x06
+#define WRITE_MULTIPLE_COILS      0x0F
+#define WRITE_MULTIPLE_REGISTERS  0x10
+
+#define EXC_ILLEGAL_FUNCTION      0x01
+#define EXC_ILLEGAL_DATA_ADDRESS  0x02
+#define EXC_ILLEGAL_DATA_VALUE    0x03
+#define EXC_SLAVE_DEVICE_BUSY     0x06
+
+#define SLAVE_ADU_SIZE            (256)
+
+// Esclavo Modbus RTU sobre la UART del NT1.
+//
+// Con el NT1 en ModbusModeSimpleProtocolConversion el gateway convierte el Modbus TCP que llega
+// de la red a tramas RTU por la UART; aca las contestamos desde una imagen de registros en RAM.
+//
+//  - Las tablas (coils, discrete inputs, holding e input registers) son arrays de la aplicacion,
+//    no se usa el heap. Los bits van empaquetados de a 8 por byte (bit 0 = primera direccion).
+//  - El fin de trama (T3.5) lo detecta el timeout de RX de la UART (por hardware), y la trama
+//    se procesa en una tarea propia, de alta prioridad y en el otro core, asi el polling del
+//    SCADA no molesta al loop() de la aplicacion.
+//  - Las tablas se protegen con un mutex: para actualizar varios registros de forma consistente
+//    usar Lock()/Unlock() (ver las restricciones ahi).
+//  - Mientras la tarea corre es la duena de la UART: para mandar comandos AT al NT1 hay que
+//    pausarla con Stop() y despues Resume().
+class ModbusRTUSlave
+{
+   private:
+    int uartNum;
+    uint8_t slaveID;
+    int tx_enabled;
+    QueueHandle_t uartQueue = NULL;
+    TaskHandle_t task       = NULL;
+    StaticSemaphore_t mutexBuffer;
+    SemaphoreHandle_t mutex;
+    StaticSemaphore_t pausedBuffer;
+    SemaphoreHandle_t paused;
+    volatile bool pauseRequest = false;
+
+    uint8_t rx[SLAVE_ADU_SIZE];
+    uint8_t tx[SLAVE_ADU_SIZE];
+    uint16_t rxLen = 0;
+    bool badFrame  = false;  // overflow o error de paridad/framing en la trama actual
+
+    uint8_t* coils         = NULL;
+    uint16_t nCoils        = 0;
+    uint8_t* discretes     = NULL;
+    uint16_t nDiscretes    = 0;
+    uint16_t* holdingRegs  = NULL;
+    uint16_t nHoldingRegs  = 0;
+    uint16_t* inputRegs    = NULL;
+    uint16_t nInputRegs    = 0;
+
+    uint32_t benchMs    = 0;
+    uint32_t benchCount = 0;
+
+    static bool GetBit(const uint8_t* table, uint16_t i) { return table[i >> 3] & (1 << (i & 7)); }
+    static void SetBit(uint8_t* table, uint16_t i, bool v)
+    {
+        if (v)
+            table[i >> 3] |= (1 << (i & 7));
+        else
+            table[i >> 3] &= ~(1 << (i & 7));
+    }
+    static bool InRange(uint16_t addr, uint16_t qty, uint16_t size) { return (uint32_t)addr + qty <= size; }
+
+    uint16_t Exception(uint8_t code)
+    {
+        tx[1] |= 0x80;
+        tx[2] = code;
+        exceptions++;
+        return 3;
+    }
+
+    // si la aplicacion tiene tomado el mutex mas de lockWaitMs, se contesta SLAVE DEVICE BUSY.
+    bool TakeTables() { return xSemaphoreTake(mutex, pdMS_TO_TICKS(lockWaitMs)) == pdTRUE; }
+    void GiveTables() { xSemaphoreGive(mutex); }
+
+    // arma la respuesta en tx[] (sin CRC) y retorna su largo.
+    // len es el largo de la trama recibida sin el CRC.
+    uint16_t Respond(uint16_t len)
+    {
+        uint8_t fc = rx[1];
+
+        tx[0] = rx[0];
+        tx[1] = fc;
+
+        switch (fc)
+        {
+            case READ_COILS:
+            case READ_DISCRETE_INPUTS:
+            case READ_HOLDING_REGISTER:
+            case READ_INPUT_REGISTERS:
+            case WRITE_SINGLE_COIL:
+            case WRITE_SINGLE_REGISTER:
+                if (len != 6) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                break;
+            case WRITE_MULTIPLE_COILS:
+            case WRITE_MULTIPLE_REGISTERS:
+                if (len < 7 || len != 7 + rx[6]) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                break;
+            default:
+                return Exception(EXC_ILLEGAL_FUNCTION);
+        }
+
+        uint16_t addr  = word(rx[2], rx[3]);
+        uint16_t value = word(rx[4], rx[5]);  // cantidad, o el valor en FC05/06
+
+        switch (fc)
+        {
+            case READ_COILS:
+            case READ_DISCRETE_INPUTS:
+            {
+                uint8_t* table = (fc == READ_COILS) ? coils : discretes;
+                uint16_t size  = (fc == READ_COILS) ? nCoils : nDiscretes;
+                if (value < 1 || value > 2000) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                if (!table || !InRange(addr, value, size)) return Exception(EXC_ILLEGAL_DATA_ADDRESS);
+                uint8_t bytes = (value + 7) / 8;
+                tx[2]         = bytes;
+                memset(&tx[3], 0, bytes);
+                if (!TakeTables()) return Exception(EXC_SLAVE_DEVICE_BUSY);
+                for (uint16_t i = 0; i < value; i++)
+                    if (GetBit(table, addr + i)) tx[3 + (i >> 3)] |= (1 << (i & 7));
+                GiveTables();
+                return 3 + bytes;
+            }
+
+            case READ_HOLDING_REGISTER:
+            case READ_INPUT_REGISTERS:
+            {
+                uint16_t* table = (fc == READ_HOLDING_REGISTER) ? holdingRegs : inputRegs;
+                uint16_t size   = (fc == READ_HOLDING_REGISTER) ? nHoldingRegs : nInputRegs;
+                if (value < 1 || value > 125) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                if (!table || !InRange(addr, value, size)) return Exception(EXC_ILLEGAL_DATA_ADDRESS);
+                tx[2] = value * 2;
+                if (!TakeTables()) return Exception(EXC_SLAVE_DEVICE_BUSY);
+                for (uint16_t i = 0; i < value; i++)
+                {
+                    tx[3 + i * 2] = highByte(table[addr + i]);
+                    tx[4 + i * 2] = lowByte(table[addr + i]);
+                }
+                GiveTables();
+                return 3 + value * 2;
+            }
+
+            case WRITE_SINGLE_COIL:
+                if (value != 0xFF00 && value != 0x0000) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                if (!coils || !InRange(addr, 1, nCoils)) return Exception(EXC_ILLEGAL_DATA_ADDRESS);
+                if (!TakeTables()) return Exception(EXC_SLAVE_DEVICE_BUSY);
+                SetBit(coils, addr, value == 0xFF00);
+                GiveTables();
+                memcpy(&tx[2], &rx[2], 4);  // eco del pedido
+                return 6;
+
+            case WRITE_SINGLE_REGISTER:
+                if (!holdingRegs || !InRange(addr, 1, nHoldingRegs)) return Exception(EXC_ILLEGAL_DATA_ADDRESS);
+                if (!TakeTables()) return Exception(EXC_SLAVE_DEVICE_BUSY);
+                holdingRegs[addr] = value;
+                GiveTables();
+                memcpy(&tx[2], &rx[2], 4);  // eco del pedido
+                return 6;
+
+            case WRITE_MULTIPLE_COILS:
+                if (value < 1 || value > 1968 || rx[6] != (value + 7) / 8) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                if (!coils || !InRange(addr, value, nCoils)) return Exception(EXC_ILLEGAL_DATA_ADDRESS);
+                if (!TakeTables()) return Exception(EXC_SLAVE_DEVICE_BUSY);
+                for (uint16_t i = 0; i < value; i++) SetBit(coils, addr + i, GetBit(&rx[7], i));
+                GiveTables();
+                memcpy(&tx[2], &rx[2], 4);  // direccion y cantidad
+                return 6;
+
+            default:  // WRITE_MULTIPLE_REGISTERS
+                if (value < 1 || value > 123 || rx[6] != value * 2) return Exception(EXC_ILLEGAL_DATA_VALUE);
+                if (!holdingRegs || !InRange(addr, value, nHoldingRegs)) return Exception(EXC_ILLEGAL_DATA_ADDRESS);
+                if (!TakeTables()) return Exception(EXC_SLAVE_DEVICE_BUSY);
+                for (uint16_t i = 0; i < value; i++) holdingRegs[addr + i] = word(rx[7 + i * 2], rx[8 + i * 2]);
+                GiveTables();
+                memcpy(&tx[2], &rx[2], 4);  // direccion y cantidad
+                return 6;
+        }
+    }
+
+    // valida la trama en rx[] y arma la respuesta con CRC en tx[].
+    // Retorna el largo a transmitir, 0 si no hay que contestar.
+    uint16_t Handle()
+    {
+        if (rxLen < 4) return 0;  // basura o ruido
+        if (rx[0] != slaveID && rx[0] != 0) return 0;
+
+        uint16_t u16CRC = 0xFFFF;
+        for (int i = 0; i < rxLen - 2; i++) u16CRC = crc16_update(u16CRC, rx[i]);
+        if (lowByte(u16CRC) != rx[rxLen - 2] || highByte(u16CRC) != rx[rxLen - 1])
+        {
+            crcErrors++;
+            return 0;
+        }
+
+        uint16_t n = Respond(rxLen - 2);
+        requests++;
+        if (rx[0] == 0) return 0;  // broadcast: se ejecuta pero no se contesta
+
+        u16CRC = 0xFFFF;
+        for (int i = 0; i < n; i++) u16CRC = crc16_update(u16CRC, tx[i]);
+        tx[n++] = lowByte(u16CRC);
+        tx[n++] = highByte(u16CRC);
+        return n;
+    }
+
+    // Largo total (con CRC) del pedido que hay en rx[], o 0 si todavia no se puede saber.
+    // Hace falta porque si el evento viene de la FIFO llena (cada 120 bytes) y la trama termina
+    // justo ahi, la UART no genera el timeout de RX hasta que llegue otro byte.
+    uint16_t ExpectedLength()
+    {
+        if (rxLen < 2) return 0;
+        switch (rx[1])
+        {
+            case READ_COILS:
+            case READ_DISCRETE_INPUTS:
+            case READ_HOLDING_REGISTER:
+            case READ_INPUT_REGISTERS:
+            case WRITE_SINGLE_COIL:
+            case WRITE_SINGLE_REGISTER:
+                return 8;
+            case WRITE_MULTIPLE_COILS:
+            case WRITE_MULTIPLE_REGISTERS:
+                return rxLen < 7 ? 0 : 9 + rx[6];
+            default:
+                return 0;  // desconocido: espero el timeout de RX
+        }
+    }
+
+    // agrega bytes a rx[] (como los va leyendo Run()); retorna true si la trama esta completa.
+    bool Append(const uint8_t* data, size_t len, bool timeout)
+    {
+        // junto los pedazos (la FIFO avisa cada 120 bytes) hasta el timeout de RX o el largo esperado
+        while (len)
+        {
+            if (rxLen == SLAVE_ADU_SIZE)
+            {
+                badFrame = true;
+                rxLen    = 0;
+            }
+            size_t chunk = min(len, (size_t)(SLAVE_ADU_SIZE - rxLen));
+            memcpy(&rx[rxLen], data, chunk);
+            rxLen += chunk;
+            data += chunk;
+            len -= chunk;
+        }
+        return timeout || (rxLen == ExpectedLength() && !badFrame);
+    }
+
+    // se llama al detectar el fin de trama (T3.5). wakeUs: cuando la tarea recibio el evento.
+    void Process(uint32_t wakeUs)
+    {
+        uint16_t n = Handle();
+        if (n == 0) return;
+
+        uint32_t elapsed = micros() - wakeUs;  // el reloj se para antes de empezar a transmitir
+        if (elapsed > maxResponseUs) maxResponseUs = elapsed;
+
+        if (tx_enabled != -1) digitalWrite(tx_enabled, 1);
+        uart_write_bytes(uartNum, tx, n);
+        uart_wait_tx_done(uartNum, 100);
+        if (tx_enabled != -1) digitalWrite(tx_enabled, 0);
+    }
+
+    void Run()
+    {
+        uart_event_t event;
+        for (;;)
+        {
+            if (xQueueReceive(uartQueue, &event, portMAX_DELAY) != pdTRUE) continue;
+            uint32_t wakeUs = micros();
+
+            if (pauseRequest)  // Stop(): suelto la UART hasta el Resume()
+            {
+                xSemaphoreGive(paused);
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+
+            switch (event.type)
+            {
+                case UART_DATA:
+                {
+                    uint8_t chunk[128];
+                    size_t len = event.size;
+                    bool done  = false;
+                    while (len)
+                    {
+                        int n = uart_read_bytes(uartNum, chunk, min(len, sizeof(chunk)), 0);
+                        if (n <= 0) break;
+                        len -= n;
+                        done = Append(chunk, n, event.timeout_flag && len == 0);
+                    }
+                    if (done)
+                    {
+                        if (!badFrame) Process(wakeUs);
+                        rxLen    = 0;
+                        badFrame = false;
+                    }
+                    break;
+                }
+
+                case UART_FIFO_OVF:
+                case UART_BUFFER_FULL:
+                    uart_flush_input(uartNum);
+                    xQueueReset(uartQueue);
+                    rxLen    = 0;
+                    badFrame = false;
+                    break;
+
+                case UART_PARITY_ERR:
+                case UART_FRAME_ERR:
+                    badFrame = true;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    static void TaskEntry(void* arg) { ((ModbusRTUSlave*)arg)->Run(); }
+
+   public:
+    uint32_t lockWaitMs = 5;  // espera maxima del esclavo por el mutex de las tablas
+
+    // estadisticas:
+    volatile uint32_t requests   = 0;  // pedidos atendidos (incluye los que devuelven excepcion)
+    volatile uint32_t exceptions = 0;
+    volatile uint32_t crcErrors  = 0;
+
+    // Peor tiempo desde que la tarea se despierta con el fin de trama hasta que empieza a transmitir
+    // (validar, leer/escribir las tablas y el CRC). El tiempo total hasta la respuesta es ademas el
+    // T3.5 (t35Us) y lo que tarda el scheduler en despertar la tarea, que no se puede medir desde aca.
+    volatile uint32_t maxResponseUs = 0;
+    uint32_t t35Us                  = 0;  // el T3.5 configurado en la UART, en us
+    float usPerChar                 = 0;  // tiempo de un caracter en la linea, en us
+    float engineRps                 = 0;  // resultado del ultimo Benchmark(): costo de CPU, NO capacidad
+
+    ModbusRTUSlave(int UartNum) : uartNum(UartNum), slaveID(1), tx_enabled(-1)
+    {
+        mutex  = xSemaphoreCreateMutexStatic(&mutexBuffer);
+        paused = xSemaphoreCreateBinaryStatic(&pausedBuffer);
+    }
+
+    void Setup(int baud, int bits, int parity, int stops, int rx_pin, int tx_pin, int tx_enabled, uint8_t slaveID)
+    {
+        this->slaveID    = slaveID;
+        this->tx_enabled = tx_enabled;  // si es RS485, aca viene el pin de TX-ENABLE del modulo 485. Sino es -1.
+
+        // necesito la cola de eventos para enterarme del timeout de RX, asi que reinstalo el driver.
+        if (uart_is_driver_installed(uartNum)) uart_driver_delete(uartNum);
+        if (uart_driver_install(uartNum, SLAVE_ADU_SIZE * 2, 0, 20, &uartQueue, 0) != ESP_OK)
+        {
+            Serial.println("Failed to install UART driver\n");
+        }
+
+        // acomodo los seteos para el IDF:
+        uart_word_length_t bts = (bits == 8 ? UART_DATA_8_BITS : (bits == 7 ? UART_DATA_7_BITS : (bits == 6 ? UART_DATA_6_BITS : UART_DATA_5_BITS)));
+        uart_parity_t par      = (parity == 'N' ? UART_PARITY_DISABLE : (parity == 'E' ? UART_PARITY_EVEN : UART_PARITY_ODD));
+        uart_stop_bits_t stpb  = (stops == 1 ? UART_STOP_BITS_1 : UART_STOP_BITS_2);
+
+        uart_config_t uart_config = {
+            .baud_rate = baud,
+            .data_bits = bts,
+            .parity    = par,
+            .stop_bits = stpb,
+            .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        };
+        uart_param_config(uartNum, &uart_config);
+
+        // T3.5: el timeout de RX se mide en tiempos de caracter. Hasta 19200 son 3.5 caracteres
+        // (redondeo a 4); arriba de 19200 la norma lo fija en 1.75 ms, asi una pausa corta del
+        // gateway en medio de la trama no la corta. El registro de la UART admite hasta ~90.
+        uint32_t charBits = 1 + bits + (parity == 'N' ? 0 : 1) + stops;
+        uint32_t t35Chars = 4;
+        if (baud > 19200) t35Chars = (uint32_t)((1750ULL * baud + charBits * 1000000ULL - 1) / (charBits * 1000000ULL));
+        if (t35Chars < 4) t35Chars = 4;
+        if (t35Chars > 90) t35Chars = 90;
+        uart_set_rx_timeout(uartNum, t35Chars);
+        t35Us = (uint32_t)((uint64_t)t35Chars * charBits * 1000000ULL / baud);
+        usPerChar = charBits * 1000000.0f / baud;
+
+        if (tx_enabled != -1)
+        {
+            pinMode(tx_enabled, OUTPUT);
+            digitalWrite(tx_enabled, 0);
+        }
+
+        uart_set_pin(uartNum, tx_pin, rx_pin, -1, -1);
+    }
+
+    // tablas de la imagen de registros (las cantidades son en bits para coils/discretes):
+    void SetCoils(uint8_t* table, uint16_t count) { coils = table, nCoils = count; }
+    void SetDiscreteInputs(uint8_t* table, uint16_t count) { discretes = table, nDiscretes = count; }
+    void SetHoldingRegisters(uint16_t* table, uint16_t count) { holdingRegs = table, nHoldingRegs = count; }
+    void SetInputRegisters(uint16_t* table, uint16_t count) { inputRegs = table, nInputRegs = count; }
+
+    // arranca la tarea del esclavo (por defecto en el core 0, el loop() de Arduino corre en el 1).
+    bool Start(UBaseType_t priority = configMAX_PRIORITIES - 2, BaseType_t core = 0)
+    {
+        if (task || !uartQueue) return false;
+        benchMs    = millis();
+        benchCount = requests;
+        return xTaskCreatePinnedToCore(TaskEntry, "ModbusSlave", 4096, this, priority, &task, core) == pdPASS;
+    }
+
+    // La tarea del esclavo lee todo lo que llega por la UART del NT1, asi que mientras corre no se
+    // pueden usar los comandos AT (EbyteNT1AT, LinkSupervisor): se comerian el +OK. Para usarlos,
+    // Stop() -> comandos AT -> Resume(). Lo que llegue del master mientras tanto se pierde.
+    // Stop() espera a que la tarea termine la respuesta en curso (acotado: lockWaitMs + transmitir).
+    void Stop()
+    {
+        if (!task || pauseRequest) return;
+        pauseRequest      = true;
+        uart_event_t wake = {};
+        wake.type         = UART_EVENT_MAX;  // evento de mentira para despertar la tarea
+        xQueueSend(uartQueue, &wake, 0);     // si la cola esta llena igual se despierta
+        xSemaphoreTake(paused, portMAX_DELAY);
+        uart_flush_input(uartNum);
+    }
+
+    void Resume()
+    {
+        if (!task || !pauseRequest) return;
+        uart_flush_input(uartNum);  // descarto las respuestas AT y lo que haya quedado
+        xQueueReset(uartQueue);
+        rxLen        = 0;
+        badFrame     = false;
+        pauseRequest = false;
+        xTaskNotifyGive(task);
+    }
+
+    // Para que la aplicacion modifique varios registros juntos sin que el esclavo lea a medias.
+    // Es un mutex (no deshabilita interrupciones), pero mientras se tiene tomado el esclavo espera
+    // hasta lockWaitMs y despues contesta SLAVE DEVICE BUSY: entre Lock() y Unlock() solo copiar
+    // datos, nada de Serial, delay() ni esperas. No usar desde una interrupcion.
+    // Retorna false si no se pudo tomar en waitMs (y entonces NO hay que llamar a Unlock()).
+    bool Lock(uint32_t waitMs = 10) { return xSemaphoreTake(mutex, pdMS_TO_TICKS(waitMs)) == pdTRUE; }
+    void Unlock() { xSemaphoreGive(mutex); }
+
+    // Benchmark del motor: procesa tramas FC03 (leer 10 registros) y FC16 (escribir 10) una tras
+    // otra durante ms milisegundos, sin la UART, y retorna cuantas por segundo procesa la CPU.
+    // Eso NO es lo que se puede atender: la linea serie es el cuello de botella (ver WireRps()).
+    // Usa los buffers de la tarea, asi que se corre antes de Start(). Las estadisticas no se tocan.
+    // Necesita al menos 10 holding registers.
+    float Benchmark(uint32_t ms)
+    {
+        if (task || !holdingRegs || nHoldingRegs < 10) return 0;
+
+        uint8_t fc03[8]  = {slaveID, READ_HOLDING_REGISTER, 0, 0, 0, 10};
+        uint8_t fc16[29] = {slaveID, WRITE_MULTIPLE_REGISTERS, 0, 0, 0, 10, 20};
+        if (!Lock()) return 0;
+        for (int i = 0; i < 20; i += 2)  // escribo lo mismo que hay, asi no se pisan los datos
+        {
+            fc16[7 + i] = highByte(holdingRegs[i / 2]);
+            fc16[8 + i] = lowByte(holdingRegs[i / 2]);
+        }
+        Unlock();
+        uint16_t u16CRC = 0xFFFF;
+        for (int i = 0; i < 6; i++) u16CRC = crc16_update(u16CRC, fc03[i]);
+        fc03[6] = lowByte(u16CRC);
+        fc03[7] = highByte(u16CRC);
+        u16CRC  = 0xFFFF;
+        for (int i = 0; i < 27; i++) u16CRC = crc16_update(u16CRC, fc16[i]);
+        fc16[27] = lowByte(u16CRC);
+        fc16[28] = highByte(u16CRC);
+
+        uint32_t savedRequests = requests, savedExceptions = exceptions, savedCrcErrors = crcErrors;
+        uint32_t count = 0;
+        uint32_t start = micros();
+        uint32_t elapsed;
+        do
+        {
+            if (count & 1)
+            {
+                memcpy(rx, fc16, sizeof(fc16));
+                rxLen = sizeof(fc16);
+            }
+            else
+            {
+                memcpy(rx, fc03, sizeof(fc03));
+                rxLen = sizeof(fc03);
+            }
+            Handle();
+            count++;
+            elapsed = micros() - start;
+        } while (elapsed < ms * 1000);
+        rxLen      = 0;
+        requests   = savedRequests;
+        exceptions = savedExceptions;
+        crcErrors  = savedCrcErrors;
+
+        engineRps = count * 1000000.0f / elapsed;
+        return engineRps;
+    }
+
+    // Pedidos por segundo que entran en la linea serie (el limite real de lo que se puede atender):
+    // pedido + respuesta + un T3.5 despues de cada uno. Por ej. FC03 de 10 registros: 8 + 25 bytes.
+    // Hay que llamar antes a Setup().
+    float WireRps(uint16_t requestBytes = 8, uint16_t responseBytes = 25)
+    {
+        float us = (requestBytes + responseBytes) * usPerChar + 2.0f * t35Us;
+        return us > 0 ? 1000000.0f / us : 0;
+    }
+
+    // Chequeo del armado de tramas: un FC15 de 888 coils mide justo 120 bytes, lo mismo que el
+    // umbral de la FIFO, asi que la UART no da el timeout de RX y la trama se tiene que cerrar por
+    // el largo. Se pasa en pedazos como los entrega Run() y se verifica la respuesta.
+    // Se corre antes de Start(); no toca las tablas ni las estadisticas.
+    bool SelfTest()
+    {
+        if (task) return false;
+
+        uint8_t testCoils[111] = {0};
+        uint8_t frame[120]     = {slaveID, WRITE_MULTIPLE_COILS, 0, 0, highByte(888), lowByte(888), 111};
+        for (int i = 7; i < 118; i++) frame[i] = 0xA5;
+        uint16_t u16CRC = 0xFFFF;
+        for (int i = 0; i < 118; i++) u16CRC = crc16_update(u16CRC, frame[i]);
+        frame[118] = lowByte(u16CRC);
+        frame[119] = highByte(u16CRC);
+
+        uint8_t* savedCoils  = coils;
+        uint16_t savedNCoils = nCoils;
+        uint32_t savedRequests = requests, savedExceptions = exceptions, savedCrcErrors = crcErrors;
+        coils  = testCoils;
+        nCoils = 888;
+
+        rxLen    = 0;
+        badFrame = false;
+        bool ok  = !Append(frame, 100, false) && Append(&frame[100], 20, false);  // sin timeout
+        ok       = ok && Handle() == 8 && tx[1] == WRITE_MULTIPLE_COILS && word(tx[4], tx[5]) == 888 && testCoils[110] == 0xA5;
+
+        rxLen      = 0;
+        coils      = savedCoils;
+        nCoils     = savedNCoils;
+        requests   = savedRequests;
+        exceptions = savedExceptions;
+        crcErrors  = savedCrcErrors;
+        return ok;
+    }
+
+    // pedidos por segundo que llegaron de verdad (del master remoto) desde la llamada anterior.
+    float RequestsPerSecond()
+    {
+        uint32_t now   = millis();
+        uint32_t count = requests;
+        float rps      = (now != benchMs) ? (count - benchCount) * 1000.0f / (now - benchMs) : 0;
+        benchMs        = now;
+        benchCount     = count;
+        return rps;
+    }
+};
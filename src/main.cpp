@@ -15,12 +15,25 @@
 #include <Arduino.h>
 #include "EbyteNT1AT.h"
 #include "ModbusRTU.h"
+#include "LinkSupervisor.h"
+#include "ModbusRTUSlave.h"
 
 #define TX_PIN 42
 #define RX_PIN 41
 
+// 1 = el ESP32 es esclavo Modbus y contesta al NT1 (gateway TCP->RTU), 0 = es maestro
+#define MODO_ESCLAVO 0
+
 ModbusRTU ModbusConn(UART_NUM_1);
 EbyteNT1AT Nt1(UART_NUM_1);
+LinkSupervisor Link(Nt1);
+ModbusRTUSlave ModbusSlave(UART_NUM_1);
+
+// imagen de registros del esclavo:
+uint8_t coils[8];
+uint8_t discretes[8];
+uint16_t holdingRegs[64];
+uint16_t inputRegs[64];
 
 void setup()
 {
@@ -28,26 +41,61 @@ void setup()
     pinMode(0, INPUT_PULLUP);
     delay(1000);
 
+#if MODO_ESCLAVO
+    ModbusSlave.Setup(115200, 8, 'N', 1, RX_PIN, TX_PIN, -1, 1);
+    ModbusSlave.SetCoils(coils, sizeof(coils) * 8);
+    ModbusSlave.SetDiscreteInputs(discretes, sizeof(discretes) * 8);
+    ModbusSlave.SetHoldingRegisters(holdingRegs, 64);
+    ModbusSlave.SetInputRegisters(inputRegs, 64);
+    // antes de arrancar la tarea: chequeo de tramas y costo de CPU del motor vs el limite de la linea
+    Serial.printf("esclavo: selftest %s\n", ModbusSlave.SelfTest() ? "OK" : "Error");
+    Serial.printf("esclavo: motor %.0f req/s (CPU, sin UART), limite de la linea %.0f req/s (FC03 x10)\n", ModbusSlave.Benchmark(1000), ModbusSlave.WireRps());
+    if (!ModbusSlave.Start()) Serial.println("Error al iniciar el esclavo");
+    // el supervisor no se usa en modo esclavo: necesita comandos AT en la misma UART.
+#else
     ModbusConn.Setup(115200, 8, 'N', 1, RX_PIN, TX_PIN, -1, 0, 1000, 0);
+    Link.Begin(Nt1.WorkModeTcpClient, "192.168.0.2", 502);
+#endif
 
     Serial.println("Listo");
 }
 
 void loop()
 {
+#if MODO_ESCLAVO
+    if (digitalRead(0) != LOW)
+    {
+        // pedidos por segundo que llegan del master (el esclavo corre en su propia tarea) vs el limite de la linea
+        uint32_t ms = millis();
+        if (ModbusSlave.Lock())
+        {
+            inputRegs[0] = highWord(ms);
+            inputRegs[1] = lowWord(ms);
+            ModbusSlave.Unlock();
+        }
+        Serial.printf("esclavo: %.1f req/s (limite de la linea %.0f req/s), total=%u exc=%u crc=%u respuesta max=%u us + T3.5 %u us\n", ModbusSlave.RequestsPerSecond(),
+                      ModbusSlave.WireRps(), ModbusSlave.requests, ModbusSlave.exceptions, ModbusSlave.crcErrors, ModbusSlave.maxResponseUs, ModbusSlave.t35Us);
+        delay(1000);
+        return;
+    }
+    ModbusSlave.Stop();  // le saco la UART al esclavo para poder mandar comandos AT
+#else
     if (digitalRead(0) != LOW)
     {
         uint32_t result = ModbusConn.ReadHoldingRegister(0, 1, 2);
         if (ModbusConn.status == 0)
         {
+            Link.Feed();  // respuesta valida => el enlace esta vivo
             Serial.printf("%04X\n", result);
         }
         else
         {
             Serial.printf("Error status=%X\n", ModbusConn.status);
         }
+        Link.Loop();
         delay(1000);
     }
+#endif
 
     if (digitalRead(0) == LOW)
     {
@@ -66,6 +114,9 @@ void loop()
             Serial.println(Nt1.QueryModbusMode());                                            //+OK=SIMPL,1000
             Serial.println(Nt1.SetModbusMode(Nt1.ModbusModeSimpleProtocolConversion, 1000));  //+OK=Modbus TCP to RTU is ON
 
+            // 4) timers cortos de reconexion para el supervisor (sin heartbeat: el PLC no lo entiende):
+            Serial.println(Link.ApplyFastTimers(2, 3) ? "timers OK" : "timers Error");
+
             //Nt1.Restart();  // tengo que resetear sino no anda...
 
             // salgo del modo AT...
@@ -77,4 +128,8 @@ void loop()
         else
             Serial.println("Error");
     }
+
+#if MODO_ESCLAVO
+    ModbusSlave.Resume();
+#endif
 }